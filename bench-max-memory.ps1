@@ -0,0 +1,86 @@
+# This file is part of file-size-tool, a directory scanner.
+# Copyright (C) 2024  Joe Desmond
+#
+# file-size-tool is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# any later version.
+#
+# file-size-tool is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with file-size-tool.  If not, see <https://www.gnu.org/licenses/>.
+
+# Fills one directory with `Count` empty files and scans it with a threshold of 0, so that
+# every file is kept. Reports the peak working set of the scan with and without
+# `--max-memory`. The directory is reused on later runs if it already has enough files.
+#
+#	> .\bench-max-memory.ps1 -Dir D:\flat -Count 20000000 -MaxMemory 16M
+
+param(
+	[Parameter(Mandatory = $true)]
+	[string] $Dir,
+	[long] $Count = 20000000,
+	[string] $MaxMemory = "16M",
+	[string] $Exe = "$PSScriptRoot\x64\Release\file-size-tool.exe",
+	[switch] $SkipUnbounded
+)
+
+$ErrorActionPreference = "Stop"
+
+if (! (Test-Path $Exe)) {
+	throw "Can't find $Exe. Build the Release|x64 configuration first."
+}
+
+New-Item -ItemType Directory -Force -Path $Dir | Out-Null
+$existing = [System.IO.Directory]::EnumerateFiles($Dir) | Measure-Object | Select-Object -ExpandProperty Count
+
+if ($existing -lt $Count) {
+	Write-Host "Creating $($Count - $existing) files in $Dir..."
+
+	for ($i = $existing; $i -lt $Count; $i++) {
+		[System.IO.File]::Create([System.IO.Path]::Combine($Dir, "f$i")).Dispose()
+	}
+}
+
+# Samples the peak working set until the process exits, because it can't be read afterwards
+function Measure-PeakWorkingSet([string[]] $ToolArgs) {
+	$out = [System.IO.Path]::GetTempFileName()
+	$watch = [System.Diagnostics.Stopwatch]::StartNew()
+	$proc = Start-Process -FilePath $Exe -ArgumentList $ToolArgs -RedirectStandardOutput $out -NoNewWindow -PassThru
+	$peak = 0
+
+	while (! $proc.HasExited) {
+		try {
+			$proc.Refresh()
+			$peak = [Math]::Max($peak, $proc.PeakWorkingSet64)
+		} catch [System.InvalidOperationException] {
+			# It exited between the check and the refresh
+		}
+
+		Start-Sleep -Milliseconds 50
+	}
+
+	$watch.Stop()
+	$lines = [System.IO.File]::ReadLines($out) | Measure-Object | Select-Object -ExpandProperty Count
+	Remove-Item $out
+
+	[PSCustomObject]@{
+		Args = $ToolArgs -join " "
+		ExitCode = $proc.ExitCode
+		Lines = $lines
+		PeakWorkingSetMB = [Math]::Round($peak / 1MB, 1)
+		Seconds = [Math]::Round($watch.Elapsed.TotalSeconds, 1)
+	}
+}
+
+$results = @(Measure-PeakWorkingSet @("`"$Dir`"", "0", "--max-memory", $MaxMemory))
+
+if (! $SkipUnbounded) {
+	$results += Measure-PeakWorkingSet @("`"$Dir`"", "0")
+}
+
+$results | Format-Table -AutoSize
@@ -19,6 +19,76 @@
 #include <Pathcch.h>
 #include "files.h"
 
+#define SPILL_WRITE_BUF_SIZE			0x10000
+#define SPILL_READ_BUF_SIZE				0x8000
+#define MAX_MERGE_FAN_IN				256
+#define ARENA_CHUNK_SIZE				0x100000
+// What a heap allocation of `size` bytes really takes up. Blocks are rounded up to 16 bytes
+// and have a header of up to 16 bytes in front of them.
+#define HEAP_CHARGE(size)				((((SIZE_T)(size) + 15) & ~(SIZE_T)15) + 16)
+// Each directory on the current path holds two path buffers while it's being scanned
+#define SCAN_BUFS_SIZE					(2 * HEAP_CHARGE(LOCAL_MAX_PATH * sizeof(WCHAR)))
+
+// File entries and skipped records are carved out of these chunks. They are never freed one
+// at a time. Instead, the whole arena is freed after each spill, when none of them are left.
+struct arena_chunk {
+	struct arena_chunk * next;
+	SIZE_T used;
+};
+typedef struct arena_chunk arena_chunk;
+
+// One level of the directory walk. The frames of every directory on the current path
+// are linked together so that all of their finished children can be spilled at once.
+struct scan_frame {
+	// The frame of the directory containing this one, or NULL at the top level
+	struct scan_frame * parent;
+	// The fully qualified path of this directory
+	LPCWSTR dir;
+	// Finished children of this directory that are still in memory
+	file_map * first_child;
+	file_map * last_child;
+};
+typedef struct scan_frame scan_frame;
+
+// Buffers writes to one of the spill files. Entry records look like this:
+//
+//	DWORD64 seq, DWORD64 size, DWORD attributes, <path>
+//
+// and skipped records look like this:
+//
+//	DWORD reason, <path>
+//
+// A path is written as two WORDs followed by some WCHARs (without a null terminator). The
+// first WORD is the number of leading characters shared with the previous path, and the
+// second WORD is the number of characters that follow. Paths in a run are in pre-order,
+// so most of each path is usually shared with the one before it.
+struct spill_writer {
+	HANDLE file;
+	// The file offset that the buffer will be written to
+	DWORD64 offset;
+	DWORD used;
+	DWORD prev_len;
+	WCHAR prev_path[LOCAL_MAX_PATH];
+	BYTE buf[SPILL_WRITE_BUF_SIZE];
+};
+typedef struct spill_writer spill_writer;
+
+// Reads records back out of a range of one of the spill files. The fields after `avail`
+// hold the last record that was read.
+typedef struct spill_reader {
+	HANDLE file;
+	// The file offset of the next byte that isn't in the buffer
+	DWORD64 offset;
+	DWORD64 end;
+	DWORD pos;
+	DWORD avail;
+	DWORD64 seq;
+	DWORD64 size;
+	DWORD attributes;
+	WCHAR path[LOCAL_MAX_PATH];
+	BYTE buf[SPILL_READ_BUF_SIZE];
+} spill_reader;
+
 static void check_path_err(HRESULT result, _In_z_ const LPCWSTR path, _In_z_ const LPCWSTR more) {
 	if (result != S_OK) {
 		print_err_fmt(L"Failed to join %1!s! and %2!s!\n", path, more);
@@ -31,172 +101,953 @@ static BOOL is_dot_path(_In_reads_z_(3) const LPCWSTR path) {
 		(path[0] == '.' && path[1] == '.' && path[2] == '\0');
 }
 
-file_map_pair measure_dir(_In_z_ const LPCWSTR dir, const DWORD64 threshold, const BOOL is_top_level) {
+static void die_corrupt_spill() {
+	print_err_fmt(L"A spill file is corrupt\n");
+	ExitProcess(1);
+}
+
+static HANDLE create_spill_file() {
+	WCHAR dir[MAX_PATH + 1];
+	WCHAR path[MAX_PATH];
+
+	DWORD len = GetTempPathW(ARR_SIZE(dir), dir);
+	check_err(! len);
+
+	UINT unique = GetTempFileNameW(dir, L"fst", 0, path);
+	check_err(! unique);
+
+	HANDLE h = CreateFileW(
+		path,
+		GENERIC_READ | GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+		NULL
+	);
+	check_err(h == INVALID_HANDLE_VALUE);
+
+	return h;
+}
+
+static void init_overlapped(_Out_ OVERLAPPED * ov, const DWORD64 offset) {
+	ov->Internal = 0;
+	ov->InternalHigh = 0;
+	ov->Offset = (DWORD)offset;
+	ov->OffsetHigh = (DWORD)(offset >> 32);
+	ov->hEvent = NULL;
+}
+
+static void write_at(HANDLE file, const DWORD64 offset, _In_reads_bytes_(len) const void * data, const DWORD len) {
+	OVERLAPPED ov;
+	init_overlapped(&ov, offset);
+
+	DWORD written = 0;
+	BOOL result = WriteFile(file, data, len, &written, &ov);
+	check_err(! result);
+
+	if (written != len) {
+		print_err_fmt(L"Failed to write to a spill file\n");
+		ExitProcess(1);
+	}
+}
+
+static void read_at(HANDLE file, const DWORD64 offset, _Out_writes_bytes_(len) void * data, const DWORD len) {
+	OVERLAPPED ov;
+	init_overlapped(&ov, offset);
+
+	DWORD num_read = 0;
+	BOOL result = ReadFile(file, data, len, &num_read, &ov);
+	check_err(! result);
+
+	if (num_read != len) {
+		die_corrupt_spill();
+	}
+}
+
+static void begin_write(_Out_ spill_writer * w, HANDLE file, const DWORD64 offset) {
+	w->file = file;
+	w->offset = offset;
+	w->used = 0;
+	w->prev_len = 0;
+}
+
+static void flush_writer(_Inout_ spill_writer * w) {
+	if (! w->used) {
+		return;
+	}
+
+	write_at(w->file, w->offset, w->buf, w->used);
+	w->offset += w->used;
+	w->used = 0;
+}
+
+// Flushes the writer and returns the file offset just past the last record.
+static DWORD64 end_write(_Inout_ spill_writer * w) {
+	flush_writer(w);
+
+	return w->offset;
+}
+
+static void spill_write(_Inout_ spill_writer * w, _In_reads_bytes_(len) const void * data, DWORD len) {
+	const BYTE * in = data;
+
+	while (len) {
+		if (w->used == SPILL_WRITE_BUF_SIZE) {
+			flush_writer(w);
+		}
+
+		DWORD n = SPILL_WRITE_BUF_SIZE - w->used;
+
+		if (n > len) {
+			n = len;
+		}
+
+		CopyMemory(w->buf + w->used, in, n);
+		w->used += n;
+		in += n;
+		len -= n;
+	}
+}
+
+static void spill_write_path(_Inout_ spill_writer * w, _In_z_ const LPCWSTR path) {
+	DWORD len = lstrlenW(path);
+	DWORD shared = 0;
+
+	while (shared < len && shared < w->prev_len && path[shared] == w->prev_path[shared]) {
+		shared++;
+	}
+
+	WORD lens[2] = { (WORD)shared, (WORD)(len - shared) };
+	spill_write(w, lens, sizeof(lens));
+	spill_write(w, path + shared, (DWORD)((len - shared) * sizeof(WCHAR)));
+
+	CopyMemory(w->prev_path + shared, path + shared, (len - shared) * sizeof(WCHAR));
+	w->prev_len = len;
+}
+
+static void spill_write_entry(
+	_Inout_ spill_writer * w,
+	const DWORD64 seq,
+	const DWORD64 size,
+	const DWORD attributes,
+	_In_z_ const LPCWSTR path
+) {
+	spill_write(w, &seq, sizeof(seq));
+	spill_write(w, &size, sizeof(size));
+	spill_write(w, &attributes, sizeof(attributes));
+	spill_write_path(w, path);
+}
+
+static void begin_read(_Out_ spill_reader * r, HANDLE file, const DWORD64 start, const DWORD64 end) {
+	r->file = file;
+	r->offset = start;
+	r->end = end;
+	r->pos = 0;
+	r->avail = 0;
+}
+
+static BOOL at_end(_In_ const spill_reader * r) {
+	return r->pos == r->avail && r->offset == r->end;
+}
+
+static void spill_read(_Inout_ spill_reader * r, _Out_writes_bytes_(len) void * data, DWORD len) {
+	BYTE * out = data;
+
+	while (len) {
+		if (r->pos == r->avail) {
+			if (r->offset == r->end) {
+				die_corrupt_spill();
+			}
+
+			DWORD64 left = r->end - r->offset;
+			DWORD chunk = left < SPILL_READ_BUF_SIZE ? (DWORD)left : SPILL_READ_BUF_SIZE;
+
+			read_at(r->file, r->offset, r->buf, chunk);
+			r->offset += chunk;
+			r->pos = 0;
+			r->avail = chunk;
+		}
+
+		DWORD n = r->avail - r->pos;
+
+		if (n > len) {
+			n = len;
+		}
+
+		CopyMemory(out, r->buf + r->pos, n);
+		r->pos += n;
+		out += n;
+		len -= n;
+	}
+}
+
+static void spill_read_path(_Inout_ spill_reader * r) {
+	WORD lens[2];
+	spill_read(r, lens, sizeof(lens));
+
+	if ((DWORD)lens[0] + lens[1] >= LOCAL_MAX_PATH) {
+		die_corrupt_spill();
+	}
+
+	spill_read(r, r->path + lens[0], (DWORD)(lens[1] * sizeof(WCHAR)));
+	r->path[lens[0] + lens[1]] = L'\0';
+}
+
+// Reads the next entry record into `r`. Returns FALSE if there are no more records.
+static BOOL spill_read_entry(_Inout_ spill_reader * r) {
+	if (at_end(r)) {
+		return FALSE;
+	}
+
+	spill_read(r, &r->seq, sizeof(r->seq));
+	spill_read(r, &r->size, sizeof(r->size));
+	spill_read(r, &r->attributes, sizeof(r->attributes));
+	spill_read_path(r);
+
+	return TRUE;
+}
+
+static SIZE_T entry_size(_In_z_ const LPCWSTR name) {
+	return sizeof(file_map) + (lstrlenW(name) + 1) * sizeof(WCHAR);
+}
+
+static SIZE_T skipped_size(_In_z_ const LPCWSTR path) {
+	return sizeof(skipped_file_map) + (lstrlenW(path) + 1) * sizeof(WCHAR);
+}
+
+static _Ret_notnull_ void * arena_alloc(_Inout_ scan_state * state, SIZE_T num_bytes) {
+	num_bytes = (num_bytes + 7) & ~(SIZE_T)7;
+	arena_chunk * chunk = state->arena;
+
+	if (! chunk || chunk->used + num_bytes > ARENA_CHUNK_SIZE) {
+		chunk = VirtualAlloc(NULL, ARENA_CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+		if (! chunk) {
+			print_err_fmt(L"Failed to allocate memory: %1!u!\n", ARENA_CHUNK_SIZE);
+			ExitProcess(1);
+		}
+
+		chunk->next = state->arena;
+		chunk->used = sizeof(arena_chunk);
+		state->arena = chunk;
+		state->retained += ARENA_CHUNK_SIZE;
+	}
+
+	void * out = (BYTE *)chunk + chunk->used;
+	chunk->used += num_bytes;
+
+	return out;
+}
+
+// Frees every file entry and skipped record at once. Nothing in the arena may be in use.
+static void free_arena(_Inout_ scan_state * state) {
+	arena_chunk * chunk = state->arena;
+
+	while (chunk) {
+		arena_chunk * next = chunk->next;
+
+		BOOL result = VirtualFree(chunk, 0, MEM_RELEASE);
+		check_err(! result);
+		state->retained -= ARENA_CHUNK_SIZE;
+
+		chunk = next;
+	}
+
+	state->arena = NULL;
+}
+
+// Allocates an entry with room for `name` and copies `name` into it. Directory entries are
+// allocated on the heap, because the directories on the current path have to outlive
+// a spill. File entries come from the arena.
+static _Ret_notnull_ file_map * alloc_entry(
+	_Inout_ scan_state * state,
+	_In_z_ const LPCWSTR name,
+	const BOOL is_dir
+) {
+	SIZE_T size = entry_size(name);
+	file_map * out;
+
+	if (is_dir) {
+		out = alloc_or_die(size);
+		state->retained += HEAP_CHARGE(size);
+	} else {
+		out = arena_alloc(state, size);
+	}
+
+	out->in_arena = ! is_dir;
+	out->filename = (WCHAR *)(out + 1);
+	CopyMemory(out->filename, name, size - sizeof(file_map));
+
+	return out;
+}
+
+// Frees the directory entries in `root`, its siblings, and all of their children, and stops
+// counting them against the memory budget. File entries are left for `free_arena`.
+static void release_file_map(_Inout_ scan_state * state, _In_opt_ const file_map * root) {
+	while (root) {
+		const file_map * sibling = root->sibling;
+
+		release_file_map(state, root->first_child);
+
+		if (! root->in_arena) {
+			state->retained -= HEAP_CHARGE(entry_size(root->filename));
+			dealloc_or_die(root);
+		}
+
+		root = sibling;
+	}
+}
+
+static void skip_entry(_Inout_ scan_state * state, _In_z_ const LPCWSTR path, const DWORD reason) {
+	SIZE_T size = skipped_size(path);
+	skipped_file_map * skipped = arena_alloc(state, size);
+	skipped->next = NULL;
+	skipped->reason = reason;
+	skipped->path = (WCHAR *)(skipped + 1);
+	CopyMemory(skipped->path, path, size - sizeof(skipped_file_map));
+
+	if (state->last_skipped) {
+		state->last_skipped->next = skipped;
+	} else {
+		state->skipped = skipped;
+	}
+
+	state->last_skipped = skipped;
+}
+
+static void add_run(_Inout_ scan_state * state, const DWORD64 start, const DWORD64 end) {
+	if (start == end) {
+		return;
+	}
+
+	if (state->num_runs == state->max_runs) {
+		DWORD old_max_runs = state->max_runs;
+		state->max_runs = state->max_runs ? state->max_runs * 2 : 16;
+		state->retained += HEAP_CHARGE(state->max_runs * sizeof(spill_run)) -
+			(old_max_runs ? HEAP_CHARGE(old_max_runs * sizeof(spill_run)) : 0);
+
+		if (state->runs) {
+			state->runs = realloc_or_die(state->runs, state->max_runs * sizeof(spill_run));
+		} else {
+			state->runs = alloc_or_die(state->max_runs * sizeof(spill_run));
+		}
+	}
+
+	state->runs[state->num_runs].start = start;
+	state->runs[state->num_runs].end = end;
+	state->num_runs++;
+}
+
+// Writes `node`, its siblings, and all of their children in pre-order.
+static void spill_file_map(_Inout_ spill_writer * w, _In_z_ const LPCWSTR dir, _In_opt_ const file_map * node) {
+	if (! node) {
+		return;
+	}
+
+	WCHAR * path_buf = alloc_or_die(LOCAL_MAX_PATH * sizeof(WCHAR));
+
+	for (; node; node = node->sibling) {
+		HRESULT result = PathCchCombineEx(path_buf, LOCAL_MAX_PATH, dir, node->filename, PATHCCH_ALLOW_LONG_PATHS);
+		check_path_err(result, dir, node->filename);
+
+		spill_write_entry(w, node->seq, node->size, node->attributes, path_buf);
+		spill_file_map(w, path_buf, node->first_child);
+	}
+
+	dealloc_or_die(path_buf);
+}
+
+// Spills the finished children of every frame from the top level down to `frame`. These
+// are all in pre-order, so they form a single sorted run.
+static void spill_frames(_Inout_ scan_state * state, _In_ scan_frame * frame) {
+	if (frame->parent) {
+		spill_frames(state, frame->parent);
+	}
+
+	spill_file_map(state->writer, frame->dir, frame->first_child);
+	release_file_map(state, frame->first_child);
+	frame->first_child = NULL;
+	frame->last_child = NULL;
+}
+
+static void begin_spilling(_Inout_ scan_state * state) {
+	if (state->writer) {
+		return;
+	}
+
+	state->writer = alloc_or_die(sizeof(spill_writer));
+	state->retained += HEAP_CHARGE(sizeof(spill_writer));
+	state->spill_file = create_spill_file();
+	state->skipped_file = create_spill_file();
+}
+
+// Appends the skipped records in memory to the skipped file. Their memory is reclaimed by
+// the next `free_arena`.
+static void spill_skipped(_Inout_ scan_state * state) {
+	if (! state->skipped) {
+		return;
+	}
+
+	spill_writer * w = state->writer;
+	begin_write(w, state->skipped_file, state->skipped_end);
+
+	for (const skipped_file_map * s = state->skipped; s; s = s->next) {
+		spill_write(w, &s->reason, sizeof(s->reason));
+		spill_write_path(w, s->path);
+	}
+
+	state->skipped_end = end_write(w);
+	state->skipped = NULL;
+	state->last_skipped = NULL;
+}
+
+static void spill(_Inout_ scan_state * state, _In_ scan_frame * frame) {
+	begin_spilling(state);
+	spill_skipped(state);
+
+	DWORD64 start = state->spill_end;
+	begin_write(state->writer, state->spill_file, start);
+	spill_frames(state, frame);
+	state->spill_end = end_write(state->writer);
+	add_run(state, start, state->spill_end);
+
+	// The only entries left in memory are the directories on the current path, and none of
+	// them have children yet, so nothing in the arena is still in use
+	free_arena(state);
+}
+
+static DWORD64 read_ticks() {
+	LARGE_INTEGER ticks;
+	QueryPerformanceCounter(&ticks);
+
+	return (DWORD64)ticks.QuadPart;
+}
+
+static DWORD64 ticks_to_us(_In_ const scan_profile * profile, const DWORD64 ticks) {
+	return ticks * 1000000 / profile->freq;
+}
+
+static void record_latency(_Inout_ latency_histogram * hist, DWORD64 us) {
+	DWORD bucket = 0;
+
+	while (us && bucket < LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	hist->counts[bucket]++;
+}
+
+static void record_slow_dir(
+	_Inout_ scan_profile * profile,
+	_In_z_ const LPCWSTR dir,
+	const DWORD64 open,
+	const DWORD64 enumerate,
+	const DWORD64 close,
+	const BOOL timed_out
+) {
+	DWORD64 total = open + enumerate + close;
+
+	if (profile->num_slowest == SLOWEST_DIRS && total <= profile->slowest[SLOWEST_DIRS - 1].total) {
+		return;
+	}
+
+	DWORD i = profile->num_slowest < SLOWEST_DIRS ? profile->num_slowest++ : SLOWEST_DIRS - 1;
+
+	while (i > 0 && profile->slowest[i - 1].total < total) {
+		CopyMemory(&profile->slowest[i], &profile->slowest[i - 1], sizeof(slow_dir));
+		i--;
+	}
+
+	slow_dir * slow = &profile->slowest[i];
+	slow->total = total;
+	slow->open = open;
+	slow->enumerate = enumerate;
+	slow->close = close;
+	slow->timed_out = timed_out;
+
+	DWORD len = lstrlenW(dir) + 1;
+	CopyMemory(slow->path, dir, len * sizeof(WCHAR));
+}
+
+// Records the times for a directory that was opened, enumerated, and closed.
+static void profile_dir(
+	_Inout_ scan_profile * profile,
+	_In_z_ const LPCWSTR dir,
+	const DWORD64 open_ticks,
+	const DWORD64 enumerate_ticks,
+	const DWORD64 close_ticks,
+	const BOOL timed_out
+) {
+	DWORD64 open = ticks_to_us(profile, open_ticks);
+	DWORD64 enumerate = ticks_to_us(profile, enumerate_ticks);
+	DWORD64 close = ticks_to_us(profile, close_ticks);
+
+	profile->num_dirs++;
+	record_latency(&profile->open, open);
+	record_latency(&profile->enumerate, enumerate);
+	record_latency(&profile->close, close);
+	record_slow_dir(profile, dir, open, enumerate, close, timed_out);
+
+	if (timed_out) {
+		profile->num_timeouts++;
+	}
+}
+
+// Records the time for a directory that could not be opened.
+static void profile_open_failure(
+	_Inout_ scan_profile * profile,
+	_In_z_ const LPCWSTR dir,
+	const DWORD64 open_ticks,
+	const BOOL timed_out
+) {
+	DWORD64 open = ticks_to_us(profile, open_ticks);
+
+	profile->num_dirs++;
+	record_latency(&profile->open, open);
+	record_slow_dir(profile, dir, open, 0, 0, timed_out);
+
+	if (timed_out) {
+		profile->num_timeouts++;
+	}
+}
+
+static DWORD WINAPI watchdog_proc(_In_ LPVOID param) {
+	scan_profile * profile = param;
+
+	while (WaitForSingleObject(profile->stop_event, profile->watchdog_interval) == WAIT_TIMEOUT) {
+		AcquireSRWLockExclusive(&profile->lock);
+
+		// The call is cancelled on every check until it's disarmed, in case the first cancel
+		// landed before the call had started. Cancelling when nothing is running is harmless.
+		if (profile->armed_until && read_ticks() >= profile->armed_until) {
+			CancelSynchronousIo(profile->scan_thread);
+		}
+
+		ReleaseSRWLockExclusive(&profile->lock);
+	}
+
+	return 0;
+}
+
+// Lets the watchdog cancel the next Find call once the directory has used up its deadline.
+// `used` is the time (in ticks) that the directory has already taken.
+static void arm_watchdog(_Inout_ scan_profile * profile, const DWORD64 used) {
+	if (! profile->watchdog) {
+		return;
+	}
+
+	AcquireSRWLockExclusive(&profile->lock);
+	profile->armed_until = read_ticks() + (used < profile->deadline ? profile->deadline - used : 0);
+	ReleaseSRWLockExclusive(&profile->lock);
+}
+
+// Once this returns, the watchdog can no longer cancel anything on the scanning thread.
+static void disarm_watchdog(_Inout_ scan_profile * profile) {
+	if (! profile->watchdog) {
+		return;
+	}
+
+	AcquireSRWLockExclusive(&profile->lock);
+	profile->armed_until = 0;
+	ReleaseSRWLockExclusive(&profile->lock);
+}
+
+// Calls `FindNextFileW` unless the directory has used up its deadline. If directories are
+// being timed, the time the call took is added to `elapsed`. If the deadline passed or the
+// watchdog cancelled the call, `timed_out` is set and FALSE is returned.
+static BOOL find_next_file(
+	_In_ const scan_state * state,
+	HANDLE h,
+	_Out_ WIN32_FIND_DATAW * file_data,
+	const DWORD64 open_ticks,
+	_Inout_ DWORD64 * elapsed,
+	_Out_ BOOL * timed_out
+) {
+	scan_profile * profile = state->profile;
+	*timed_out = FALSE;
+
+	if (! profile) {
+		return FindNextFileW(h, file_data);
+	}
+
+	if (profile->deadline && open_ticks + *elapsed > profile->deadline) {
+		*timed_out = TRUE;
+		return FALSE;
+	}
+
+	arm_watchdog(profile, open_ticks + *elapsed);
+
+	DWORD64 start = read_ticks();
+	BOOL result = FindNextFileW(h, file_data);
+	DWORD err = GetLastError();
+	*elapsed += read_ticks() - start;
+
+	disarm_watchdog(profile);
+
+	if (! result && err == ERROR_OPERATION_ABORTED && profile->watchdog) {
+		*timed_out = TRUE;
+	}
+
+	return result;
+}
+
+// Calls `FindFirstFileW` with the watchdog armed. `used` is the time (in ticks) that the
+// directory has already taken, and the time this call takes is added to it. If the
+// directory is already past its deadline or the call is cancelled, INVALID_HANDLE_VALUE is
+// returned with `ERROR_TIMEOUT` in `err`.
+static HANDLE find_first_file(
+	_In_ const scan_state * state,
+	_In_z_ const LPCWSTR path,
+	_Out_ WIN32_FIND_DATAW * file_data,
+	_Inout_ DWORD64 * used,
+	_Out_ DWORD * err
+) {
+	scan_profile * profile = state->profile;
+	HANDLE h;
+
+	if (! profile) {
+		h = FindFirstFileW(path, file_data);
+		*err = GetLastError();
+
+		return h;
+	}
+
+	if (profile->deadline && *used > profile->deadline) {
+		*err = ERROR_TIMEOUT;
+
+		return INVALID_HANDLE_VALUE;
+	}
+
+	arm_watchdog(profile, *used);
+
+	DWORD64 start = read_ticks();
+	h = FindFirstFileW(path, file_data);
+	*err = GetLastError();
+	*used += read_ticks() - start;
+
+	disarm_watchdog(profile);
+
+	if (h == INVALID_HANDLE_VALUE && *err == ERROR_OPERATION_ABORTED && profile->watchdog) {
+		*err = ERROR_TIMEOUT;
+	}
+
+	return h;
+}
+
+// Calls `FindClose`. The close gets a deadline of its own, because it can need a round trip
+// to the server. The time it takes is added to `elapsed`. If the close fails, FALSE is
+// returned with the error in `err`. A cancelled close fails with `ERROR_TIMEOUT`.
+static BOOL find_close(_In_ const scan_state * state, HANDLE h, _Inout_ DWORD64 * elapsed, _Out_ DWORD * err) {
+	scan_profile * profile = state->profile;
+	BOOL result;
+
+	if (! profile) {
+		result = FindClose(h);
+		*err = GetLastError();
+
+		return result;
+	}
+
+	arm_watchdog(profile, 0);
+
+	DWORD64 start = read_ticks();
+	result = FindClose(h);
+	*err = GetLastError();
+	*elapsed += read_ticks() - start;
+
+	disarm_watchdog(profile);
+
+	if (! result && *err == ERROR_OPERATION_ABORTED && profile->watchdog) {
+		*err = ERROR_TIMEOUT;
+	}
+
+	return result;
+}
+
+static void free_scan_bufs(_Inout_ scan_state * state, _In_ WCHAR * path_buf, _In_ WCHAR * child_buf) {
+	dealloc_or_die(path_buf);
+	dealloc_or_die(child_buf);
+	state->retained -= SCAN_BUFS_SIZE;
+}
+
+static _Ret_maybenull_ file_map * scan_dir(
+	_Inout_ scan_state * state,
+	_In_z_ const LPCWSTR dir,
+	_In_opt_ scan_frame * parent
+) {
 	WCHAR * path_buf = alloc_or_die(LOCAL_MAX_PATH * sizeof(WCHAR));
 	WCHAR * child_buf = alloc_or_die(LOCAL_MAX_PATH * sizeof(WCHAR));
+	state->retained += SCAN_BUFS_SIZE;
 	HRESULT result = PathCchCombineEx(path_buf, LOCAL_MAX_PATH, dir, L"*", PATHCCH_ALLOW_LONG_PATHS);
 	check_path_err(result, dir, L"*");
 
-	file_map * out = alloc_or_die(sizeof(file_map));
+	file_map * out = alloc_entry(state, dir, TRUE);
+	out->first_child = NULL;
 	out->sibling = NULL;
-	CopyMemory(out->filename, dir, MAX_PATH * sizeof(WCHAR));
+	out->seq = state->next_seq++;
 
 	WIN32_FIND_DATAW file_data;
 	HANDLE h;
+	DWORD err;
 
-	if (is_top_level) {
-		h = FindFirstFileW(dir, &file_data);
+	scan_profile * profile = state->profile;
+	DWORD64 open_ticks = 0;
+	DWORD64 enumerate_ticks = 0;
+	DWORD64 close_ticks = 0;
+	BOOL timed_out = FALSE;
 
-		if (h == INVALID_HANDLE_VALUE) {
-			DWORD err = GetLastError();
-			skipped_file_map * skipped = alloc_or_die(sizeof(skipped_file_map));
-			skipped->next = NULL;
-			skipped->reason = err;
+	if (! parent) {
+		// The root is probed for its attributes first. This counts as part of opening it.
+		h = find_first_file(state, dir, &file_data, &open_ticks, &err);
 
-			DWORD len = lstrlenW(dir) + 1;
-			CopyMemory(skipped->path, dir, len * sizeof(WCHAR));
+		if (h != INVALID_HANDLE_VALUE) {
+			out->attributes = file_data.dwFileAttributes;
 
-			file_map_pair pair;
-			pair.root = NULL;
-			pair.skipped = skipped;
+			if (! find_close(state, h, &open_ticks, &err)) {
+				if (err != ERROR_TIMEOUT) {
+					SetLastError(err);
+					check_err(TRUE);
+				}
 
-			dealloc_or_die(path_buf);
-			dealloc_or_die(child_buf);
-			return pair;
+				h = INVALID_HANDLE_VALUE;
+			}
 		}
 
-		out->attributes = file_data.dwFileAttributes;
+		if (h == INVALID_HANDLE_VALUE) {
+			if (profile) {
+				profile_open_failure(profile, dir, open_ticks, err == ERROR_TIMEOUT);
+			}
 
-		BOOL close_result = FindClose(h);
-		check_err(! close_result);
+			skip_entry(state, dir, err);
+			release_file_map(state, out);
+
+			free_scan_bufs(state, path_buf, child_buf);
+			return NULL;
+		}
 	}
 
-	h = FindFirstFileW(path_buf, &file_data);
+	h = find_first_file(state, path_buf, &file_data, &open_ticks, &err);
 
 	if (h == INVALID_HANDLE_VALUE) {
-		DWORD err = GetLastError();
-		skipped_file_map * skipped = alloc_or_die(sizeof(skipped_file_map));
-		skipped->next = NULL;
-		skipped->reason = err;
-
-		DWORD len = lstrlenW(dir) + 1;
-		CopyMemory(skipped->path, dir, len * sizeof(WCHAR));
+		if (profile) {
+			profile_open_failure(profile, dir, open_ticks, err == ERROR_TIMEOUT);
+		}
 
-		file_map_pair pair;
-		pair.root = NULL;
-		pair.skipped = skipped;
+		skip_entry(state, dir, err);
+		release_file_map(state, out);
 
-		dealloc_or_die(path_buf);
-		dealloc_or_die(child_buf);
-		return pair;
+		free_scan_bufs(state, path_buf, child_buf);
+		return NULL;
 	}
 
-	file_map * root = NULL;
-	file_map * curr = NULL;
-	file_map * next = NULL;
+	scan_frame frame;
+	frame.parent = parent;
+	frame.dir = dir;
+	frame.first_child = NULL;
+	frame.last_child = NULL;
+
+	file_map * next;
 	DWORD64 total_size = 0;
-	file_map_pair sub_result;
-	skipped_file_map * skipped_root = NULL;
-	skipped_file_map * skipped_curr = NULL;
 
 	do {
+		if (state->max_memory && state->retained > state->max_memory) {
+			spill(state, &frame);
+		}
+
 		if (is_dot_path(file_data.cFileName)) {
 			continue;
 		} else if (file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
 			result = PathCchCombineEx(child_buf, LOCAL_MAX_PATH, dir, file_data.cFileName, PATHCCH_ALLOW_LONG_PATHS);
 			check_path_err(result, dir, file_data.cFileName);
 
-			sub_result = measure_dir(child_buf, threshold, FALSE);
-			next = sub_result.root;
-
-			if (sub_result.skipped) {
-				if (skipped_curr) {
-					skipped_curr->next = sub_result.skipped;
-					skipped_curr = skipped_curr->next;
-				} else {
-					skipped_root = sub_result.skipped;
-					skipped_curr = skipped_root;
-				}
-			}
+			next = scan_dir(state, child_buf, &frame);
 
 			if (! next) {
 				continue;
 			}
 
 			next->attributes = file_data.dwFileAttributes;
+			total_size += next->size;
+
+			// If a directory is under the threshold then so is everything in it, so it
+			// has no children left at this point
+			if (next->size < state->threshold) {
+				release_file_map(state, next);
+				continue;
+			}
 		} else {
-			next = alloc_or_die(sizeof(file_map));
+			DWORD64 size = ((DWORD64)file_data.nFileSizeHigh << 32) | file_data.nFileSizeLow;
+			total_size += size;
+
+			// Small files are discarded right away, but their sizes are still accounted for
+			if (size < state->threshold) {
+				continue;
+			}
+
+			next = alloc_entry(state, file_data.cFileName, FALSE);
 			next->first_child = NULL;
 			next->sibling = NULL;
-			next->size = ((DWORD64)file_data.nFileSizeHigh << 32) | file_data.nFileSizeLow;
-			CopyMemory(next->filename, file_data.cFileName, MAX_PATH * sizeof(WCHAR));
+			next->size = size;
+			next->seq = state->next_seq++;
 			next->attributes = file_data.dwFileAttributes;
 		}
 
-		if (curr) {
-			curr->sibling = next;
+		if (frame.last_child) {
+			frame.last_child->sibling = next;
+		} else {
+			frame.first_child = next;
 		}
 
-		curr = next;
+		frame.last_child = next;
+	} while (find_next_file(state, h, &file_data, open_ticks, &enumerate_ticks, &timed_out));
 
-		if (! root) {
-			root = curr;
+	// A handle whose calls were cancelled or that ran out of time can fail to close as well.
+	// That's part of the same timeout, and it shouldn't end the whole scan.
+	if (! find_close(state, h, &close_ticks, &err)) {
+		if (! timed_out && err != ERROR_TIMEOUT) {
+			SetLastError(err);
+			check_err(TRUE);
 		}
 
-		total_size += curr->size;
-	} while (FindNextFileW(h, &file_data));
+		timed_out = TRUE;
+	}
+
+	if (profile) {
+		profile_dir(profile, dir, open_ticks, enumerate_ticks, close_ticks, timed_out);
+	}
 
-	BOOL close_result = FindClose(h);
-	check_err(! close_result);
+	// Whatever was found before the deadline is kept, but the directory is still reported
+	// so that its size isn't mistaken for the whole thing
+	if (timed_out) {
+		skip_entry(state, dir, ERROR_TIMEOUT);
+	}
 
-	out->first_child = root;
+	out->first_child = frame.first_child;
 	out->size = total_size;
 
-	file_map * prev = NULL;
-	curr = out->first_child;
+	free_scan_bufs(state, path_buf, child_buf);
+	return out;
+}
 
-	// Remove all child nodes with size < threshold
-	while (curr) {
-		if (curr->size < threshold) {
-			if (prev) {
-				prev->sibling = curr->sibling;
-			} else {
-				out->first_child = curr->sibling;
-			}
+void init_scan_state(_Out_ scan_state * state, const DWORD64 threshold, const DWORD64 max_memory) {
+	state->threshold = threshold;
+	state->max_memory = max_memory;
+	state->retained = 0;
+	state->next_seq = 0;
+	state->skipped = NULL;
+	state->last_skipped = NULL;
+	state->arena = NULL;
+	state->writer = NULL;
+	state->spill_file = INVALID_HANDLE_VALUE;
+	state->spill_end = 0;
+	state->runs = NULL;
+	state->num_runs = 0;
+	state->max_runs = 0;
+	state->skipped_file = INVALID_HANDLE_VALUE;
+	state->skipped_end = 0;
+	state->profile = NULL;
+}
 
-			file_map * next = curr->sibling;
-			curr->sibling = NULL;
+void free_scan_state(_Inout_ scan_state * state) {
+	if (state->writer) {
+		BOOL close_result = CloseHandle(state->spill_file);
+		check_err(! close_result);
 
-			free_file_map(curr);
-			curr = next;
-		} else {
-			prev = curr;
-			curr = curr->sibling;
-		}
+		close_result = CloseHandle(state->skipped_file);
+		check_err(! close_result);
+
+		dealloc_or_die(state->writer);
+		state->writer = NULL;
 	}
 
-	file_map_pair pair;
-	pair.root = out;
-	pair.skipped = skipped_root;
+	if (state->runs) {
+		dealloc_or_die(state->runs);
+		state->runs = NULL;
+	}
 
-	dealloc_or_die(path_buf);
-	dealloc_or_die(child_buf);
-	return pair;
+	if (state->profile) {
+		scan_profile * profile = state->profile;
+
+		if (profile->watchdog) {
+			BOOL result = SetEvent(profile->stop_event);
+			check_err(! result);
+
+			DWORD wait_result = WaitForSingleObject(profile->watchdog, INFINITE);
+			check_err(wait_result == WAIT_FAILED);
+
+			CloseHandle(profile->watchdog);
+			CloseHandle(profile->stop_event);
+			CloseHandle(profile->scan_thread);
+		}
+
+		dealloc_or_die(profile);
+		state->profile = NULL;
+	}
+
+	free_arena(state);
+	state->skipped = NULL;
+	state->last_skipped = NULL;
 }
 
-void print_file_map(_In_z_ const LPCWSTR dir, _In_opt_ const file_map * node) {
-	if (! node) {
-		return;
+void enable_profiling(_Inout_ scan_state * state, const DWORD64 deadline_ms) {
+	scan_profile * profile = alloc_or_die(sizeof(scan_profile));
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	profile->freq = (DWORD64)freq.QuadPart;
+	profile->deadline = deadline_ms * profile->freq / 1000;
+	profile->num_dirs = 0;
+	profile->num_timeouts = 0;
+	profile->num_slowest = 0;
+
+	for (DWORD i = 0; i < LATENCY_BUCKETS; i++) {
+		profile->open.counts[i] = 0;
+		profile->enumerate.counts[i] = 0;
+		profile->close.counts[i] = 0;
 	}
 
-	static WCHAR size_buf[BYTES_TO_SIZE_MAX_CHARS];
-	WCHAR * path_buf = alloc_or_die(LOCAL_MAX_PATH * sizeof(WCHAR));
-	HRESULT result = PathCchCombineEx(path_buf, LOCAL_MAX_PATH, dir, node->filename, PATHCCH_ALLOW_LONG_PATHS);
-	check_path_err(result, dir, node->filename);
+	profile->scan_thread = NULL;
+	profile->watchdog = NULL;
+	profile->stop_event = NULL;
+	profile->armed_until = 0;
+	InitializeSRWLock(&profile->lock);
+
+	if (deadline_ms) {
+		// `CancelSynchronousIo` needs a real handle to this thread, not the pseudo-handle
+		profile->scan_thread = OpenThread(THREAD_TERMINATE, FALSE, GetCurrentThreadId());
+		check_err(! profile->scan_thread);
+
+		profile->stop_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+		check_err(! profile->stop_event);
+
+		DWORD64 interval = deadline_ms / 4;
+
+		if (interval < 1) {
+			interval = 1;
+		} else if (interval > 100) {
+			interval = 100;
+		}
+
+		profile->watchdog_interval = (DWORD)interval;
+
+		profile->watchdog = CreateThread(NULL, 0, watchdog_proc, profile, 0, NULL);
+		check_err(! profile->watchdog);
+	}
+
+	state->profile = profile;
+}
 
+_Ret_maybenull_ file_map * measure_dir(_Inout_ scan_state * state, _In_z_ const LPCWSTR root_dir) {
+	return scan_dir(state, root_dir, NULL);
+}
+
+static void print_entry(_In_z_ const LPCWSTR path, const DWORD64 size, const DWORD attributes) {
+	static WCHAR size_buf[BYTES_TO_SIZE_MAX_CHARS];
 	LPCWSTR entry_type;
 
-	if (node->attributes & FILE_ATTRIBUTE_DIRECTORY) {
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
 		entry_type = can_use_colors ? L"\x1b[93md\x1b[0m" : L"d";
 	} else {
 		entry_type = can_use_colors ? L"\x1b[37mf\x1b[0m" : L"f";
@@ -206,24 +1057,16 @@ void print_file_map(_In_z_ const LPCWSTR dir, _In_opt_ const file_map * node) {
 		L"\x1b[94m%1!s!\x1b[0m\t\t%2!s!\t%3!s!\n" :
 		L"%1!s!\t\t%2!s!\t%3!s!\n";
 
-	bytes_to_size(size_buf, node->size);
-	print_fmt(fmt_str, size_buf, entry_type, path_buf);
-
-	print_file_map(path_buf, node->first_child);
-	print_file_map(dir, node->sibling);
-	dealloc_or_die(path_buf);
+	bytes_to_size(size_buf, size);
+	print_fmt(fmt_str, size_buf, entry_type, path);
 }
 
-void print_skipped_file_map(_In_opt_ const skipped_file_map * root) {
-	if (! root) {
-		return;
-	}
-
+static void print_skipped_entry(_In_z_ const LPCWSTR path, const DWORD reason) {
 	LPWSTR err_buf = NULL;
 	FormatMessageW(
 		FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
 		NULL,
-		root->reason,
+		reason,
 		0,
 		(LPWSTR)&err_buf,
 		0,
@@ -235,32 +1078,276 @@ void print_skipped_file_map(_In_opt_ const skipped_file_map * root) {
 	const LPCWSTR fmt_str = can_use_colors ?
 		L"%1!s!: \x1b[31m%2!s!\x1b[0m" :
 		L"%1!s!: %2!s!";
-	print_fmt(fmt_str, root->path, err_buf ? err_buf : default_err);
+	print_fmt(fmt_str, path, err_buf ? err_buf : default_err);
 
 	if (err_buf) {
 		LocalFree(err_buf);
 	}
+}
+
+static void sift_down(_Inout_updates_(count) spill_reader ** readers, const DWORD count, DWORD i) {
+	while (TRUE) {
+		DWORD smallest = i;
+		DWORD left = 2 * i + 1;
+		DWORD right = left + 1;
 
-	print_skipped_file_map(root->next);
+		if (left < count && readers[left]->seq < readers[smallest]->seq) {
+			smallest = left;
+		}
+
+		if (right < count && readers[right]->seq < readers[smallest]->seq) {
+			smallest = right;
+		}
+
+		if (smallest == i) {
+			return;
+		}
+
+		spill_reader * tmp = readers[i];
+		readers[i] = readers[smallest];
+		readers[smallest] = tmp;
+		i = smallest;
+	}
 }
 
-void free_file_map(_In_opt_ const file_map * root) {
-	if (! root) {
+// Merges `count` runs by `seq`. The entries are written to `out` if it's given, otherwise
+// they're printed.
+static void merge_runs(
+	_In_ const scan_state * state,
+	_In_reads_(count) const spill_run * runs,
+	const DWORD count,
+	_Inout_opt_ spill_writer * out
+) {
+	spill_reader ** readers = alloc_or_die(count * sizeof(spill_reader *));
+	DWORD num_readers = 0;
+
+	for (DWORD i = 0; i < count; i++) {
+		spill_reader * r = alloc_or_die(sizeof(spill_reader));
+		begin_read(r, state->spill_file, runs[i].start, runs[i].end);
+
+		if (spill_read_entry(r)) {
+			readers[num_readers++] = r;
+		} else {
+			dealloc_or_die(r);
+		}
+	}
+
+	for (DWORD i = num_readers / 2; i > 0; i--) {
+		sift_down(readers, num_readers, i - 1);
+	}
+
+	while (num_readers) {
+		spill_reader * r = readers[0];
+
+		if (out) {
+			spill_write_entry(out, r->seq, r->size, r->attributes, r->path);
+		} else {
+			print_entry(r->path, r->size, r->attributes);
+		}
+
+		if (! spill_read_entry(r)) {
+			dealloc_or_die(r);
+			readers[0] = readers[--num_readers];
+		}
+
+		sift_down(readers, num_readers, 0);
+	}
+
+	dealloc_or_die(readers);
+}
+
+// Merges groups of `fan_in` runs into single runs at the end of the spill file.
+static void compact_runs(_Inout_ scan_state * state, const DWORD fan_in) {
+	DWORD num_merged = 0;
+
+	for (DWORD i = 0; i < state->num_runs; i += fan_in) {
+		DWORD count = state->num_runs - i;
+
+		if (count > fan_in) {
+			count = fan_in;
+		}
+
+		if (count == 1) {
+			state->runs[num_merged++] = state->runs[i];
+			continue;
+		}
+
+		DWORD64 start = state->spill_end;
+		begin_write(state->writer, state->spill_file, start);
+		merge_runs(state, state->runs + i, count, state->writer);
+		state->spill_end = end_write(state->writer);
+
+		state->runs[num_merged].start = start;
+		state->runs[num_merged].end = state->spill_end;
+		num_merged++;
+	}
+
+	state->num_runs = num_merged;
+}
+
+void print_scan(_Inout_ scan_state * state, _In_opt_ file_map * root) {
+	if (! state->writer) {
+		print_file_map(L"", root);
+		free_file_map(root);
 		return;
 	}
 
-	free_file_map(root->sibling);
-	free_file_map(root->first_child);
+	// Whatever is still in memory becomes the last run
+	spill_skipped(state);
+
+	DWORD64 start = state->spill_end;
+	begin_write(state->writer, state->spill_file, start);
+	spill_file_map(state->writer, L"", root);
+	state->spill_end = end_write(state->writer);
+	add_run(state, start, state->spill_end);
+	release_file_map(state, root);
+	free_arena(state);
+
+	// The readers have to fit in whatever is left of the budget. By now that's only the
+	// spill writer and the run table.
+	DWORD64 left = state->max_memory > state->retained ? state->max_memory - state->retained : 0;
+	DWORD64 max_readers = left / (HEAP_CHARGE(sizeof(spill_reader)) + sizeof(spill_reader *));
+	DWORD fan_in = max_readers > MAX_MERGE_FAN_IN ? MAX_MERGE_FAN_IN : (DWORD)max_readers;
+
+	if (fan_in < 2) {
+		fan_in = 2;
+	}
 
-	dealloc_or_die(root);
+	while (state->num_runs > fan_in) {
+		compact_runs(state, fan_in);
+	}
+
+	merge_runs(state, state->runs, state->num_runs, NULL);
+}
+
+BOOL has_skipped(_In_ const scan_state * state) {
+	return state->skipped || state->skipped_end;
+}
+
+void print_skipped(_In_ const scan_state * state) {
+	if (state->skipped_end) {
+		spill_reader * r = alloc_or_die(sizeof(spill_reader));
+		begin_read(r, state->skipped_file, 0, state->skipped_end);
+
+		while (! at_end(r)) {
+			DWORD reason;
+			spill_read(r, &reason, sizeof(reason));
+			spill_read_path(r);
+			print_skipped_entry(r->path, reason);
+		}
+
+		dealloc_or_die(r);
+	}
+
+	print_skipped_file_map(state->skipped);
+}
+
+void print_profile(_In_ const scan_state * state) {
+	const scan_profile * profile = state->profile;
+	WCHAR time_buf[US_TO_TIME_MAX_CHARS];
+	WCHAR open_buf[US_TO_TIME_MAX_CHARS];
+	WCHAR enumerate_buf[US_TO_TIME_MAX_CHARS];
+	WCHAR close_buf[US_TO_TIME_MAX_CHARS];
+
+	print_fmt(L"Directories: %1!I64u!, timed out: %2!I64u!\n\n", profile->num_dirs, profile->num_timeouts);
+
+	DWORD first = LATENCY_BUCKETS;
+	DWORD last = 0;
+
+	for (DWORD i = 0; i < LATENCY_BUCKETS; i++) {
+		if (profile->open.counts[i] || profile->enumerate.counts[i] || profile->close.counts[i]) {
+			first = first < i ? first : i;
+			last = i;
+		}
+	}
+
+	if (first < LATENCY_BUCKETS) {
+		print_fmt(L"\tTime\t\tOpen\tEnum\tClose\n");
+	}
+
+	const LPCWSTR row_fmt_str = can_use_colors ?
+		L"\t%1!s!\x1b[94m%2!s!\x1b[0m\t\t%3!I64u!\t%4!I64u!\t%5!I64u!\n" :
+		L"\t%1!s!%2!s!\t\t%3!I64u!\t%4!I64u!\t%5!I64u!\n";
+
+	for (DWORD i = first; i <= last && first < LATENCY_BUCKETS; i++) {
+		// The last bucket has no upper bound, so it's labeled with its lower bound instead
+		BOOL is_last = i == LATENCY_BUCKETS - 1;
+		us_to_time(time_buf, is_last ? (1ULL << (i - 1)) : (1ULL << i));
+
+		print_fmt(
+			row_fmt_str,
+			is_last ? L">=" : L"<",
+			time_buf,
+			profile->open.counts[i],
+			profile->enumerate.counts[i],
+			profile->close.counts[i]
+		);
+	}
+
+	if (! profile->num_slowest) {
+		return;
+	}
+
+	print_fmt(L"\nSlowest directories:\n\n\tTotal\tOpen\tEnum\tClose\n");
+
+	const LPCWSTR slow_fmt_str = can_use_colors ?
+		L"\t\x1b[94m%1!s!\x1b[0m\t%2!s!\t%3!s!\t%4!s!\t%5!s!%6!s!\n" :
+		L"\t%1!s!\t%2!s!\t%3!s!\t%4!s!\t%5!s!%6!s!\n";
+
+	for (DWORD i = 0; i < profile->num_slowest; i++) {
+		const slow_dir * slow = &profile->slowest[i];
+
+		us_to_time(time_buf, slow->total);
+		us_to_time(open_buf, slow->open);
+		us_to_time(enumerate_buf, slow->enumerate);
+		us_to_time(close_buf, slow->close);
+
+		print_fmt(
+			slow_fmt_str,
+			time_buf,
+			open_buf,
+			enumerate_buf,
+			close_buf,
+			slow->path,
+			slow->timed_out ? L" (timed out)" : L""
+		);
+	}
 }
 
-void free_skipped_file_map(_In_opt_ const skipped_file_map * root) {
-	if (! root) {
+void print_file_map(_In_z_ const LPCWSTR dir, _In_opt_ const file_map * node) {
+	if (! node) {
 		return;
 	}
 
-	free_skipped_file_map(root->next);
+	WCHAR * path_buf = alloc_or_die(LOCAL_MAX_PATH * sizeof(WCHAR));
+
+	for (; node; node = node->sibling) {
+		HRESULT result = PathCchCombineEx(path_buf, LOCAL_MAX_PATH, dir, node->filename, PATHCCH_ALLOW_LONG_PATHS);
+		check_path_err(result, dir, node->filename);
+
+		print_entry(path_buf, node->size, node->attributes);
+		print_file_map(path_buf, node->first_child);
+	}
+
+	dealloc_or_die(path_buf);
+}
+
+void print_skipped_file_map(_In_opt_ const skipped_file_map * root) {
+	for (; root; root = root->next) {
+		print_skipped_entry(root->path, root->reason);
+	}
+}
 
-	dealloc_or_die(root);
+void free_file_map(_In_opt_ const file_map * root) {
+	while (root) {
+		const file_map * sibling = root->sibling;
+
+		free_file_map(root->first_child);
+
+		if (! root->in_arena) {
+			dealloc_or_die(root);
+		}
+
+		root = sibling;
+	}
 }
@@ -20,8 +20,14 @@
 
 #define ARR_SIZE(T)						(sizeof (T) / sizeof ((T)[0]))
 #define BYTES_TO_SIZE_MAX_CHARS			16
+#define US_TO_TIME_MAX_CHARS			16
 #define SIZE_SCALE						1000L
 #define LOCAL_MAX_PATH					4096
+// The smallest budget accepted for `--max-memory`. Anything lower would spill after only
+// a handful of entries.
+#define MIN_MAX_MEMORY					(16 * SIZE_SCALE * SIZE_SCALE)
+#define LATENCY_BUCKETS					32
+#define SLOWEST_DIRS					10
 
 extern int _fltused;
 
@@ -49,10 +55,16 @@ struct file_map {
 	DWORD64 size;
 	// The path segment of this entry. Taken with the parent's path, this forms a unique key
 	// into the structure. If this is the root entry, then this will be the fully qualified
-	// path of the root.
-	WCHAR filename[LOCAL_MAX_PATH];
+	// path of the root. This points just past the structure, in the same allocation.
+	WCHAR * filename;
 	// File attributes. These come from the `WIN32_FIND_DATAW` structure.
 	DWORD attributes;
+	// TRUE if this entry was carved out of the scan's arena instead of allocated on the heap.
+	// File entries come from the arena and directory entries come from the heap.
+	BOOL in_arena;
+	// The position of this entry in a pre-order walk of the scanned tree. Entries that
+	// were spilled to disk are merged back together in this order.
+	DWORD64 seq;
 };
 typedef struct file_map file_map;
 
@@ -61,22 +73,106 @@ typedef struct file_map file_map;
 struct skipped_file_map {
 	// The next skipped entry, or NULL if this is the last one
 	struct skipped_file_map * next;
-	// The full path to this entry
-	WCHAR path[LOCAL_MAX_PATH];
+	// The full path to this entry. This points just past the structure, in the same allocation.
+	WCHAR * path;
 	// An error code from `GetLastError` that gives the reason why this entry was skipped
 	DWORD reason;
 };
 typedef struct skipped_file_map skipped_file_map;
 
-typedef struct file_map_pair {
-	file_map * root;
+// A contiguous range of the spill file holding entries sorted by `seq`.
+typedef struct spill_run {
+	DWORD64 start;
+	DWORD64 end;
+} spill_run;
+
+// Counts how long something took. Bucket 0 counts times under 1 microsecond, and bucket
+// `i` counts times from 2^(i-1) up to 2^i microseconds. The last bucket also counts
+// anything slower than that.
+typedef struct latency_histogram {
+	DWORD64 counts[LATENCY_BUCKETS];
+} latency_histogram;
+
+// One of the slowest directories in a scan. Times are in microseconds.
+typedef struct slow_dir {
+	DWORD64 total;
+	DWORD64 open;
+	DWORD64 enumerate;
+	DWORD64 close;
+	BOOL timed_out;
+	WCHAR path[LOCAL_MAX_PATH];
+} slow_dir;
+
+// Per-directory timings for a scan. "Open" is the `FindFirstFileW` call, "enumerate" is
+// every `FindNextFileW` call, and "close" is the `FindClose` call. Time spent in
+// subdirectories is not counted against their parent.
+typedef struct scan_profile {
+	// Ticks per second, from `QueryPerformanceFrequency`
+	DWORD64 freq;
+	// If opening and enumerating a directory takes longer than this many ticks, the rest of
+	// it is skipped. If this is zero, there is no deadline.
+	DWORD64 deadline;
+	DWORD64 num_dirs;
+	DWORD64 num_timeouts;
+	latency_histogram open;
+	latency_histogram enumerate;
+	latency_histogram close;
+	// The slowest directories by total time, slowest first
+	DWORD num_slowest;
+	slow_dir slowest[SLOWEST_DIRS];
+	// These are only set up if there is a deadline. A Find call that is still running once
+	// `armed_until` passes is cancelled by the watchdog thread with `CancelSynchronousIo`.
+	HANDLE scan_thread;
+	HANDLE watchdog;
+	HANDLE stop_event;
+	// How often the watchdog checks the current call, in milliseconds
+	DWORD watchdog_interval;
+	SRWLOCK lock;
+	// The tick count after which the current call is cancelled, or zero if no call is being
+	// watched. This is guarded by `lock`.
+	DWORD64 armed_until;
+} scan_profile;
+
+struct spill_writer;
+struct arena_chunk;
+
+// State shared by every directory in a scan. Once the scan takes up more than `max_memory`
+// bytes, finished entries are written to a temporary file as sorted runs and skipped records
+// are appended to another temporary file. Both are deleted when the state is freed.
+typedef struct scan_state {
+	// Entries with a size lower than this are discarded
+	DWORD64 threshold;
+	// The most memory that the scan may take up, in bytes. This covers retained entries,
+	// skipped records, the path buffers for each directory on the current path, the run
+	// table, and the buffers used to spill and merge entries. The short-lived path buffers used while
+	// writing out a run are not counted. If this is zero, nothing is ever spilled.
+	DWORD64 max_memory;
+	// The memory currently counted against `max_memory`, in bytes
+	DWORD64 retained;
+	// The `seq` that will be given to the next entry
+	DWORD64 next_seq;
+	// Skipped records that have not been spilled, in the order they were found
 	skipped_file_map * skipped;
-} file_map_pair;
+	skipped_file_map * last_skipped;
+	// File entries and skipped records are allocated from here
+	struct arena_chunk * arena;
+	// This is NULL until the first spill
+	struct spill_writer * writer;
+	HANDLE spill_file;
+	DWORD64 spill_end;
+	spill_run * runs;
+	DWORD num_runs;
+	DWORD max_runs;
+	HANDLE skipped_file;
+	DWORD64 skipped_end;
+	// This is NULL unless directories are being timed
+	scan_profile * profile;
+} scan_state;
 
+// Frees the heap-allocated entries in `root`. Entries in the scan's arena are freed along
+// with the scan state.
 void free_file_map(_In_opt_ const file_map * root);
 
-void free_skipped_file_map(_In_opt_ const skipped_file_map * root);
-
 // This is called before `wmain` to initialize some of the global constants that are used
 // by other functions declared here.
 void init_globals();
@@ -90,6 +186,10 @@ void check_err(BOOL cond);
 // not zero-initialized.
 _Ret_notnull_ void * alloc_or_die(SIZE_T num_bytes);
 
+// Resizes some memory obtained with `alloc_or_die` to `num_bytes` bytes, and exits if
+// the reallocation fails. The old pointer must not be used afterwards.
+_Ret_notnull_ void * realloc_or_die(_In_ void * mem, SIZE_T num_bytes);
+
 // Deallocates/frees some memory obtained with `alloc_or_die`. If the deallocation fails,
 // the program exits.
 void dealloc_or_die(_In_ const void * mem);
@@ -106,11 +206,38 @@ void print_fmt(_In_z_ const LPCWSTR fmt_str, ...);
 // Prints a formatted string to stderr.
 void print_err_fmt(_In_z_ const LPCWSTR fmt_str, ...);
 
+// Sets up a scan. `max_memory` is the most memory that retained entries may take up before
+// they are spilled to disk, or zero for no limit.
+void init_scan_state(_Out_ scan_state * state, const DWORD64 threshold, const DWORD64 max_memory);
+
+// Closes and deletes the spill files and frees any skipped records still in memory.
+void free_scan_state(_Inout_ scan_state * state);
+
+// Times every directory in the scan. If `deadline_ms` is not zero, a directory that takes
+// longer than this to open and enumerate is recorded as skipped with `ERROR_TIMEOUT`. Whatever
+// was found in it before the deadline is kept. A watchdog thread cancels any Find call that
+// is still blocked when the deadline passes.
+void enable_profiling(_Inout_ scan_state * state, const DWORD64 deadline_ms);
+
 // Measures the size of a directory and all child entries. Entries with a size lower than
-// the given threshold are discarded, but their sizes are still accounted for. An entry for
-// the root directory is returned, along with any directories that could not be entered for
-// whatever reason.
-file_map_pair measure_dir(_In_z_ const LPCWSTR root_dir, const DWORD64 threshold, const BOOL is_top_level);
+// the threshold are discarded, but their sizes are still accounted for. An entry for
+// the root directory is returned, or NULL if it could not be entered. Any directories that
+// could not be entered for whatever reason are recorded as skipped in `state`.
+_Ret_maybenull_ file_map * measure_dir(_Inout_ scan_state * state, _In_z_ const LPCWSTR root_dir);
+
+// Prints the result of a scan and frees `root`. If some entries were spilled to disk, the
+// rest are spilled as well and all of the runs are merged back out in the order the entries
+// were found.
+void print_scan(_Inout_ scan_state * state, _In_opt_ file_map * root);
+
+// Returns TRUE if any directories were skipped during the scan.
+BOOL has_skipped(_In_ const scan_state * state);
+
+// Prints every skipped directory, including those that were spilled to disk.
+void print_skipped(_In_ const scan_state * state);
+
+// Prints the latency histograms and the slowest directories. Profiling must be enabled.
+void print_profile(_In_ const scan_state * state);
 
 void print_file_map(_In_z_ const LPCWSTR dir, _In_opt_ const file_map * root);
 
@@ -128,3 +255,14 @@ DWORD64 size_to_bytes(_In_z_ const LPWSTR size_str);
 // unit, the fractional part will be written with 2 digits of precision. If the fractional part
 // is zero, no fractional part will be indicated (e.g., '5K' will be written instead of '5.00K').
 void bytes_to_size(_Out_writes_(BYTES_TO_SIZE_MAX_CHARS) WCHAR str[BYTES_TO_SIZE_MAX_CHARS], const DWORD64 size);
+
+// Converts the given time string to milliseconds. The time string may end with "ms"
+// (milliseconds) or 's' (seconds). If there is no suffix, the unit is assumed to be
+// milliseconds. The numeric part of the string must be a non-negative integer. It can be
+// given in decimal or hexadecimal (with an '0x' prefix).
+DWORD64 time_to_ms(_In_z_ const LPWSTR time_str);
+
+// Converts the given time `us` (in microseconds) to a string and writes the result to `str`.
+// The time may be converted to milliseconds or seconds, and the unit is given by a suffix
+// ("us", "ms", or "s"). Fractional parts are written like they are in `bytes_to_size`.
+void us_to_time(_Out_writes_(US_TO_TIME_MAX_CHARS) WCHAR str[US_TO_TIME_MAX_CHARS], const DWORD64 us);
@@ -21,13 +21,23 @@
 #include "files.h"
 
 const WCHAR HELP_TEXT[] =
-L"Usage: %1!s! <dir> <threshold>\n\n"
+L"Usage: %1!s! <dir> <threshold> [--max-memory <size>] [--profile] [--deadline <time>]\n\n"
 L"\tThis tool reports files and directories larger than a given size.\n\n"
 L"\t<dir> is the directory to scan. All subdirectories and files will be scanned.\n"
 L"\t<threshold> is a size string like '50K', '0x20M', or '1G'. This string must be\n"
 L"\ta positive integer. It can be decimal or hexadecimal, and it can be followed by\n"
 L"\t'K' (kilobytes), 'M' (megabytes), or 'G' (gigabytes). If no scale is provided,\n"
-L"\tbytes are assumed."
+L"\tbytes are assumed.\n\n"
+L"\t--max-memory <size> limits the memory used to hold the results. Once the results\n"
+L"\tgrow past this size, they are moved into temporary files and merged back together\n"
+L"\twhen they are printed. The size must be at least 16M.\n\n"
+L"\t--profile times how long each directory takes to open, enumerate, and close. A\n"
+L"\treport with latency histograms and the slowest directories is printed at the end.\n\n"
+L"\t--deadline <time> limits how long a directory can take to open and enumerate, not\n"
+L"\tcounting its subdirectories. The time is in milliseconds, or seconds with an 's'\n"
+L"\tsuffix. A call that is still blocked when the deadline passes is cancelled. A\n"
+L"\tdirectory that runs out of time is reported as skipped, and only what was found\n"
+L"\tbefore the deadline is counted."
 L"\n\n"
 L"file-size-tool is licensed under the GNU Public License 3 or any later version at your choice.\n"
 L"See https://github.com/Dezzmeister/file-size-tool/blob/master/COPYING for details.\n"
@@ -61,28 +71,76 @@ int wmain(const int argc, WCHAR ** const argv) {
 	}
 
 	DWORD64 threshold = size_to_bytes(argv[2]);
-	file_map_pair pair = measure_dir(argv[1], threshold, TRUE);
+	DWORD64 max_memory = 0;
+	BOOL profile = FALSE;
+	DWORD64 deadline_ms = 0;
 
-	if (pair.root && pair.root->size < threshold) {
+	for (int i = 3; i < argc; i++) {
+		BOOL needs_value = ! lstrcmpiW(argv[i], L"--max-memory") || ! lstrcmpiW(argv[i], L"--deadline");
+
+		if (needs_value && i + 1 >= argc) {
+			print_err_fmt(L"Option '%1!s!' needs a value\n", argv[i]);
+			return 1;
+		}
+
+		if (! lstrcmpiW(argv[i], L"--max-memory")) {
+			max_memory = size_to_bytes(argv[++i]);
+
+			if (max_memory < MIN_MAX_MEMORY) {
+				print_err_fmt(L"Memory limit must be at least 16M: '%1!s!'\n", argv[i]);
+				return 1;
+			}
+		} else if (! lstrcmpiW(argv[i], L"--profile")) {
+			profile = TRUE;
+		} else if (! lstrcmpiW(argv[i], L"--deadline")) {
+			deadline_ms = time_to_ms(argv[++i]);
+		} else {
+			print_err_fmt(L"Unknown option: '%1!s!'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	scan_state state;
+	init_scan_state(&state, threshold, max_memory);
+
+	if (profile || deadline_ms) {
+		enable_profiling(&state, deadline_ms);
+	}
+
+	file_map * root = measure_dir(&state, argv[1]);
+
+	if (root && root->size < threshold) {
 		print_err_fmt(L"No files or directories found with size less than %1!s!\n", argv[2]);
 
-		if (pair.skipped) {
+		if (has_skipped(&state)) {
 			print_err_fmt(L"\nSome directories were skipped:\n\n");
-			print_skipped_file_map(pair.skipped);
+			print_skipped(&state);
+		}
+
+		if (profile) {
+			print_err_fmt(L"\nDirectory latency:\n\n");
+			print_profile(&state);
 		}
 
+		// This also stops the watchdog thread, which would otherwise keep the process alive
+		free_scan_state(&state);
+
 		return 1;
 	}
 
-	print_file_map(L"", pair.root);
+	print_scan(&state, root);
 
-	if (pair.skipped) {
+	if (has_skipped(&state)) {
 		print_err_fmt(L"\nSome directories were skipped:\n\n");
-		print_skipped_file_map(pair.skipped);
+		print_skipped(&state);
+	}
+
+	if (profile) {
+		print_err_fmt(L"\nDirectory latency:\n\n");
+		print_profile(&state);
 	}
 
-	free_file_map(pair.root);
-	free_skipped_file_map(pair.skipped);
+	free_scan_state(&state);
 
 	return 0;
 }
\ No newline at end of file
@@ -72,6 +72,17 @@ _Ret_notnull_ void * alloc_or_die(SIZE_T num_bytes) {
 	return out;
 }
 
+_Ret_notnull_ void * realloc_or_die(_In_ void * mem, SIZE_T num_bytes) {
+	void * out = HeapReAlloc(heap, HEAP_GENERATE_EXCEPTIONS, mem, num_bytes);
+
+	if (! out) {
+		print_err_fmt(L"Failed to reallocate memory: %1!u!\n", num_bytes);
+		ExitProcess(1);
+	}
+
+	return out;
+}
+
 void dealloc_or_die(_In_ void * mem) {
 	BOOL result = HeapFree(heap, 0, mem);
 	check_err(! result);
@@ -153,12 +164,12 @@ DWORD64 size_to_bytes(_In_z_ const LPWSTR size_str) {
 	size_str[str_len - 1] = last_char;
 
 	if (! result) {
-		print_err_fmt(L"Invalid threshold size: '%1!s!'\n", size_str);
+		print_err_fmt(L"Invalid size: '%1!s!'\n", size_str);
 		ExitProcess(1);
 	}
 
 	if (num < 0) {
-		print_err_fmt(L"Threshold size cannot be negative: '%1!s!'\n", size_str);
+		print_err_fmt(L"Size cannot be negative: '%1!s!'\n", size_str);
 		ExitProcess(1);
 	}
 
@@ -208,6 +219,83 @@ void bytes_to_size(_Out_writes_(BYTES_TO_SIZE_MAX_CHARS) WCHAR str[BYTES_TO_SIZE
 		static const WCHAR err[] = L"Failed to format byte string\n";
 		WriteConsole(std_err, err, ARR_SIZE(err), NULL, NULL);
 
+		ExitProcess(1);
+	}
+}
+
+DWORD64 time_to_ms(_In_z_ const LPWSTR time_str) {
+	int str_len = lstrlenW(time_str);
+	int suffix_len = 0;
+	DWORD64 factor = 1;
+
+	if (str_len >= 2 &&
+		(time_str[str_len - 2] == L'M' || time_str[str_len - 2] == L'm') &&
+		(time_str[str_len - 1] == L'S' || time_str[str_len - 1] == L's')) {
+		suffix_len = 2;
+	} else if (str_len >= 1 && (time_str[str_len - 1] == L'S' || time_str[str_len - 1] == L's')) {
+		factor = 1000;
+		suffix_len = 1;
+	}
+
+	WCHAR suffix_start = time_str[str_len - suffix_len];
+	time_str[str_len - suffix_len] = '\0';
+
+	LONGLONG num;
+	BOOL result = StrToInt64ExW(time_str, STIF_SUPPORT_HEX, &num);
+	time_str[str_len - suffix_len] = suffix_start;
+
+	if (! result) {
+		print_err_fmt(L"Invalid time: '%1!s!'\n", time_str);
+		ExitProcess(1);
+	}
+
+	if (num < 0) {
+		print_err_fmt(L"Time cannot be negative: '%1!s!'\n", time_str);
+		ExitProcess(1);
+	}
+
+	return num * factor;
+}
+
+void us_to_time(_Out_writes_(US_TO_TIME_MAX_CHARS) WCHAR str[US_TO_TIME_MAX_CHARS], const DWORD64 us) {
+	DWORD64 scale_f;
+	LPCWSTR unit;
+
+	if (us < 1000) {
+		scale_f = 1;
+		unit = L"us";
+	} else if (us < 1000 * 1000) {
+		scale_f = 1000;
+		unit = L"ms";
+	} else {
+		scale_f = 1000 * 1000;
+		unit = L"s";
+	}
+
+	DWORD64 time_whole = us / scale_f;
+	DWORD64 time_frac = (us % scale_f) * 100 / scale_f;
+
+	LPCWSTR zeroes = L"";
+
+	if (time_frac < 10) {
+		zeroes = L"0";
+	}
+
+	const LPCWSTR fmt_str = (scale_f == 1 || time_frac == 0) ? L"%1!d!%4!s!" : L"%1!d!.%2!s!%3!d!%4!s!";
+	DWORD_PTR args[] = { (DWORD_PTR)time_whole, (DWORD_PTR)zeroes, (DWORD_PTR)time_frac, (DWORD_PTR)unit };
+	DWORD num_chars = FormatMessageW(
+		FORMAT_MESSAGE_FROM_STRING | FORMAT_MESSAGE_ARGUMENT_ARRAY,
+		fmt_str,
+		0, 0,
+		str,
+		US_TO_TIME_MAX_CHARS,
+		(va_list *) args
+	);
+
+	if (! num_chars) {
+		static const WCHAR err[] = L"Failed to format time string\n";
+		WriteConsole(std_err, err, ARR_SIZE(err), NULL, NULL);
+
 		ExitProcess(1);
 	}
 }
\ No newline at end of file